@@ -1,12 +1,38 @@
 #include "clang/Basic/Version.h"
+#include "clang/Frontend/CompilerInvocation.h"
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
 
 #include "DotGenerator.h"
 #include "HsmAstMatcher.h"
 #include "HsmTypes.h"
+#include "StringHelpers.h"
+#include "TuScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <signal.h>
+#endif
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -32,20 +58,284 @@ static cl::opt<bool> DotLeftRightOrdering(
     "lr", cl::desc("dot option: left-right ordering (default is top-down)"),
     cl::cat(HsmAnalyzeCategory));
 
+static cl::opt<bool> SkipFunctionBodies(
+    "skip-bodies",
+    cl::desc("Skip parsing function bodies outside of hsm::State-derived "
+             "classes (faster, uses less memory)"),
+    cl::cat(HsmAnalyzeCategory));
+
+static cl::opt<bool>
+    ShowProgress("progress",
+                 cl::desc("Print progress and ETA to stderr (default on)"),
+                 cl::init(true), cl::cat(HsmAnalyzeCategory));
+
+static cl::opt<unsigned> NumParallelJobs(
+    "j",
+    cl::desc("Number of TUs to analyze in parallel, each in its own process "
+             "(default 1)"),
+    cl::value_desc("n"), cl::init(1), cl::cat(HsmAnalyzeCategory));
+
+static cl::opt<std::string> TimingsFile(
+    "timings",
+    cl::desc("File to load and save per-TU analysis times, used to start the "
+             "slowest TUs first (reduces total time with -j)"),
+    cl::value_desc("filename"), cl::cat(HsmAnalyzeCategory));
+
+static cl::opt<unsigned> TuTimeBudget(
+    "tu-time-budget",
+    cl::desc("Skip any TU that takes longer than this to analyze (0 = none)"),
+    cl::value_desc("seconds"), cl::init(0), cl::cat(HsmAnalyzeCategory));
+
+static cl::opt<unsigned> TuMemoryBudget(
+    "tu-memory-budget",
+    cl::desc("Skip any TU that needs more memory than this to analyze "
+             "(0 = none)"),
+    cl::value_desc("megabytes"), cl::init(0), cl::cat(HsmAnalyzeCategory));
+
+// Used internally to analyze a single TU in a child process when a budget is
+// set, so that the TU can be abandoned if it goes over budget.
+static cl::opt<std::string> ChildSourcePath("child-tu", cl::Hidden,
+                                            cl::cat(HsmAnalyzeCategory));
+static cl::opt<std::string> ChildOutputPath("child-output", cl::Hidden,
+                                            cl::cat(HsmAnalyzeCategory));
+
 static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
 
 static void PrintVersion() {
   outs() << ToolName << " " << ToolVersiona << '\n';
 }
 
+// Exit code of a child process that failed to allocate memory
+static const int ChildOutOfMemoryExitCode = 3;
+
+static void ChildOutOfMemoryHandler() {
+  llvm::errs() << ToolName << ": out of memory\n";
+  llvm::errs().flush();
+  std::_Exit(ChildOutOfMemoryExitCode);
+}
+
+static void ChildBadAllocErrorHandler(void *, const std::string &Reason,
+                                      bool) {
+  llvm::errs() << ToolName << ": " << Reason << "\n";
+  llvm::errs().flush();
+  std::_Exit(ChildOutOfMemoryExitCode);
+}
+
+static void killProcess(const sys::ProcessInfo &PI) {
+#ifdef _WIN32
+  ::TerminateProcess(PI.ProcessHandle, 1);
+#else
+  ::kill(PI.Pid, SIGKILL);
+#endif
+}
+
+enum class TuStatus {
+  Done,
+  Failed,
+  OverBudget,
+};
+
+// Each line is: <source state>\t<transition type>\t<target state>
+static bool writeMap(const std::string &FilePath,
+                     const StateTransitionMap &Map) {
+  // Binary mode so that state names don't pick up a '\r' on Windows
+  std::error_code EC;
+  raw_fd_ostream OS(FilePath, EC, sys::fs::F_None);
+  if (EC)
+    return false;
+  for (auto &kvp : Map) {
+    OS << kvp.first << '\t' << static_cast<int>(std::get<0>(kvp.second))
+       << '\t' << std::get<1>(kvp.second) << '\n';
+  }
+  return true;
+}
+
+static bool readMap(const std::string &FilePath, StateTransitionMap &Map) {
+  auto Buffer = MemoryBuffer::getFile(FilePath);
+  if (!Buffer)
+    return false;
+
+  SmallVector<StringRef, 64> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+  for (auto Line : Lines) {
+    SmallVector<StringRef, 3> Fields;
+    Line.rtrim('\r').split(Fields, '\t');
+    int TransType = 0;
+    if (Fields.size() != 3 || Fields[1].getAsInteger(10, TransType))
+      return false;
+    Map.insert(std::make_pair(
+        Fields[0].str(), std::make_tuple(static_cast<TransitionType>(TransType),
+                                         Fields[2].str())));
+  }
+  return true;
+}
+
+// Normalized absolute path, used to match TUs with their jobs and timings
+static std::string getAbsolutePath(StringRef Path) {
+  SmallString<256> AbsolutePath(Path);
+  sys::fs::make_absolute(AbsolutePath);
+  sys::path::remove_dots(AbsolutePath, true);
+  return AbsolutePath.str().str();
+}
+
+using TuStartedCallback = std::function<void(const std::string &SourcePath)>;
+using TuFinishedCallback = std::function<void(const std::string &SourcePath,
+                                              double Seconds, bool Success)>;
+
+// Wraps a ToolAction to report when each TU starts and finishes
+class TuProgressAction : public ToolAction {
+  ToolAction &_Action;
+  TuStartedCallback _OnStarted;
+  TuFinishedCallback _OnFinished;
+
+public:
+  TuProgressAction(ToolAction &Action, TuStartedCallback OnStarted,
+                   TuFinishedCallback OnFinished)
+      : _Action(Action), _OnStarted(std::move(OnStarted)),
+        _OnFinished(std::move(OnFinished)) {}
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    // ClangTool changes to the compile command's directory before running
+    // the invocation, so relative input paths resolve correctly here.
+    const auto &Inputs = Invocation->getFrontendOpts().Inputs;
+    auto SourcePath =
+        Inputs.empty() ? std::string() : getAbsolutePath(Inputs[0].getFile());
+
+    if (_OnStarted)
+      _OnStarted(SourcePath);
+    auto StartTime = std::chrono::steady_clock::now();
+    bool Success = _Action.runInvocation(std::move(Invocation), Files,
+                                         std::move(PCHContainerOps),
+                                         DiagConsumer);
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - StartTime;
+    if (_OnFinished)
+      _OnFinished(SourcePath, Elapsed.count(), Success);
+    return Success;
+  }
+};
+
+// Analyzes all TUs, in order, with a single ClangTool so that they share its
+// file manager (and its cache of header stats and contents).
+static int analyzeInProcess(const CompilationDatabase &Compilations,
+                            const std::vector<std::string> &SourcePaths,
+                            MatchFinder &Finder,
+                            TuStartedCallback OnStarted = nullptr,
+                            TuFinishedCallback OnFinished = nullptr) {
+  ClangTool Tool(Compilations, SourcePaths);
+  auto Factory =
+      HsmAstMatcher::newFrontendActionFactory(Finder, SkipFunctionBodies);
+  TuProgressAction Action(*Factory, std::move(OnStarted),
+                          std::move(OnFinished));
+  return Tool.run(&Action);
+}
+
+// Re-runs this executable with the same arguments on a single TU, subject to
+// the time and memory budgets, and merges the resulting transitions into Map.
+// ToolArgs must be the unmodified command line, including "--" and anything
+// after it.
+static TuStatus
+analyzeInChildProcess(const std::vector<const char *> &ToolArgs,
+                      const std::string &SourcePath, StateTransitionMap &Map,
+                      std::string &ErrMsg) {
+  SmallString<128> OutputPath;
+  if (auto EC = sys::fs::createTemporaryFile("hsm-analyze", "map",
+                                             OutputPath)) {
+    ErrMsg = EC.message();
+    return TuStatus::Failed;
+  }
+  FileRemover OutputRemover(OutputPath);
+
+  auto Executable =
+      sys::fs::getMainExecutable(ToolArgs[0], (void *)&PrintVersion);
+  auto ChildSourceArg = "-child-tu=" + SourcePath;
+  auto ChildOutputArg = "-child-output=" + OutputPath.str().str();
+
+  std::vector<const char *> Args = {Executable.c_str(), ChildSourceArg.c_str(),
+                                    ChildOutputArg.c_str()};
+  Args.insert(Args.end(), ToolArgs.begin() + 1, ToolArgs.end());
+  Args.push_back(nullptr);
+
+  bool ExecutionFailed = false;
+  auto PI = sys::ExecuteNoWait(Executable, Args.data(), nullptr, nullptr,
+                               TuMemoryBudget, &ErrMsg, &ExecutionFailed);
+  if (ExecutionFailed)
+    return TuStatus::Failed;
+
+  // Poll the child rather than passing the time budget to sys::Wait, which
+  // uses a process-wide alarm that breaks when several workers wait at once.
+  const auto Deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(TuTimeBudget);
+  sys::ProcessInfo WaitResult;
+  for (;;) {
+    WaitResult = sys::Wait(PI, 0, false, &ErrMsg);
+    if (WaitResult.Pid != 0)
+      break;
+
+    if (TuTimeBudget > 0 && std::chrono::steady_clock::now() >= Deadline) {
+      killProcess(PI);
+      sys::Wait(PI, 0, true);
+      ErrMsg = FormatString<>("exceeded time budget of %us",
+                              static_cast<unsigned>(TuTimeBudget))
+                   .value();
+      return TuStatus::OverBudget;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  const auto Result = WaitResult.ReturnCode;
+
+  // Most of Clang's memory comes from allocators that call malloc directly,
+  // and don't always report failure before crashing, so under a memory budget
+  // a child killed by a signal is assumed to have run out of memory.
+  if (TuMemoryBudget > 0 &&
+      (Result == ChildOutOfMemoryExitCode || Result < 0)) {
+    std::string Reason = FormatString<>("exceeded memory budget of %uMB",
+                                        static_cast<unsigned>(TuMemoryBudget))
+                             .value();
+    if (!ErrMsg.empty())
+      Reason += " (" + ErrMsg + ")";
+    ErrMsg = Reason;
+    return TuStatus::OverBudget;
+  }
+  if (Result != 0)
+    return TuStatus::Failed;
+
+  if (!readMap(OutputPath.str().str(), Map)) {
+    ErrMsg = "could not read analysis results";
+    return TuStatus::Failed;
+  }
+  return TuStatus::Done;
+}
+
 int main(int argc, const char **argv) {
   cl::AddExtraVersionPrinter(PrintVersion);
 
+  // CommonOptionsParser truncates argc at "--", so keep the full command line
+  // to forward it to child processes.
+  const std::vector<const char *> ToolArgs(argv, argv + argc);
+
   CommonOptionsParser OptionsParser(argc, argv, HsmAnalyzeCategory,
                                     ToolDescription);
 
-  ClangTool Tool(OptionsParser.getCompilations(),
-                 OptionsParser.getSourcePathList());
+  if (!ChildSourcePath.empty()) {
+    // Report running out of memory with a known exit code rather than
+    // crashing, so the parent can tell it apart from other failures. This
+    // covers operator new and LLVM's own allocation failure checks.
+    std::set_new_handler(ChildOutOfMemoryHandler);
+    llvm::install_bad_alloc_error_handler(ChildBadAllocErrorHandler);
+
+    StateTransitionMap Map;
+    MatchFinder Finder;
+    HsmAstMatcher::addMatchers(Finder, Map);
+    auto Result = analyzeInProcess(OptionsParser.getCompilations(),
+                                   {ChildSourcePath}, Finder);
+    if (Result != 0 || !writeMap(ChildOutputPath, Map))
+      return 1;
+    return 0;
+  }
 
   if (!(PrintMap || PrintDotFile)) {
     llvm::errs() << "Nothing to do. Please specify "
@@ -54,11 +344,148 @@ int main(int argc, const char **argv) {
     return -1;
   }
 
+  // Use absolute paths so that timings match across working directories
+  std::vector<std::string> SourcePaths;
+  for (auto &Path : OptionsParser.getSourcePathList())
+    SourcePaths.push_back(getAbsolutePath(Path));
+
+  TuScheduler::TimingMap Timings;
+  if (!TimingsFile.empty())
+    Timings = TuScheduler::loadTimings(TimingsFile);
+
+  const auto Jobs = TuScheduler::scheduleByCost(SourcePaths, Timings);
+  const unsigned NumWorkers =
+      std::max(1u, std::min<unsigned>(NumParallelJobs, Jobs.size()));
+  const bool UseChildProcesses =
+      NumWorkers > 1 || TuTimeBudget > 0 || TuMemoryBudget > 0;
+
   StateTransitionMap Map;
   MatchFinder Finder;
   HsmAstMatcher::addMatchers(Finder, Map);
 
-  auto Result = Tool.run(newFrontendActionFactory(&Finder).get());
+  TuScheduler::ProgressReporter Progress(llvm::errs(), Jobs);
+  std::vector<std::string> SkippedTus;
+  int Result = 0;
+
+  auto OnJobStarted = [&](const TuScheduler::Job &J) {
+    if (ShowProgress)
+      Progress.jobStarted(J);
+  };
+
+  auto OnJobFinished = [&](const TuScheduler::Job &J, double Seconds,
+                           TuStatus Status, const std::string &ErrMsg) {
+    Timings[J.SourcePath] = Seconds;
+
+    const char *StatusString = "done";
+    if (Status == TuStatus::Failed) {
+      Result = 1;
+      StatusString = "failed";
+      if (!ErrMsg.empty())
+        llvm::errs() << J.SourcePath << ": " << ErrMsg << "\n";
+    } else if (Status == TuStatus::OverBudget) {
+      SkippedTus.push_back(J.SourcePath + ": " + ErrMsg);
+      StatusString = "skipped";
+    }
+
+    if (ShowProgress)
+      Progress.jobFinished(J, Seconds, StatusString);
+  };
+
+  if (UseChildProcesses) {
+    // Each worker takes the next most expensive job, so that with more than
+    // one worker, slow TUs don't end up running alone at the end.
+    std::mutex Mutex;
+    size_t NextJob = 0;
+    auto RunJobs = [&] {
+      for (;;) {
+        const TuScheduler::Job *J = nullptr;
+        {
+          std::lock_guard<std::mutex> Lock(Mutex);
+          if (NextJob == Jobs.size())
+            return;
+          J = &Jobs[NextJob++];
+          OnJobStarted(*J);
+        }
+
+        auto StartTime = std::chrono::steady_clock::now();
+        StateTransitionMap TuMap;
+        std::string ErrMsg;
+        auto Status =
+            analyzeInChildProcess(ToolArgs, J->SourcePath, TuMap, ErrMsg);
+        std::chrono::duration<double> Elapsed =
+            std::chrono::steady_clock::now() - StartTime;
+
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Map.insert(TuMap.begin(), TuMap.end());
+        OnJobFinished(*J, Elapsed.count(), Status, ErrMsg);
+      }
+    };
+
+    std::vector<std::thread> Workers;
+    for (unsigned i = 1; i < NumWorkers; ++i)
+      Workers.emplace_back(RunJobs);
+    RunJobs();
+    for (auto &Worker : Workers)
+      Worker.join();
+  } else {
+    std::map<std::string, TuScheduler::Job> JobsByPath;
+    std::vector<std::string> ScheduledPaths;
+    for (auto &J : Jobs) {
+      JobsByPath[J.SourcePath] = J;
+      ScheduledPaths.push_back(J.SourcePath);
+    }
+
+    // A source file may have several compile commands, which the tool runs
+    // one after the other, so a job is only finished once the tool moves on
+    // to the next file (or is done).
+    const TuScheduler::Job *CurrentJob = nullptr;
+    double CurrentSeconds = 0;
+    bool CurrentSuccess = true;
+
+    auto finishCurrentJob = [&] {
+      if (!CurrentJob)
+        return;
+      OnJobFinished(*CurrentJob, CurrentSeconds,
+                    CurrentSuccess ? TuStatus::Done : TuStatus::Failed, "");
+      CurrentJob = nullptr;
+    };
+
+    auto ToolResult = analyzeInProcess(
+        OptionsParser.getCompilations(), ScheduledPaths, Finder,
+        [&](const std::string &SourcePath) {
+          if (CurrentJob && CurrentJob->SourcePath == SourcePath)
+            return;
+          finishCurrentJob();
+          auto iter = JobsByPath.find(SourcePath);
+          if (iter == JobsByPath.end())
+            return;
+          CurrentJob = &iter->second;
+          CurrentSeconds = 0;
+          CurrentSuccess = true;
+          OnJobStarted(*CurrentJob);
+        },
+        [&](const std::string &SourcePath, double Seconds, bool Success) {
+          if (!CurrentJob || CurrentJob->SourcePath != SourcePath) {
+            if (!Success)
+              Result = 1;
+            return;
+          }
+          CurrentSeconds += Seconds;
+          CurrentSuccess = CurrentSuccess && Success;
+        });
+    finishCurrentJob();
+
+    // Also catches TUs the tool skipped, e.g. for lack of a compile command
+    if (ToolResult != 0)
+      Result = ToolResult;
+  }
+
+  if (!TimingsFile.empty() && !TuScheduler::saveTimings(TimingsFile, Timings))
+    llvm::errs() << "Failed to write timings file: " << TimingsFile << "\n";
+
+  for (auto &SkippedTu : SkippedTus)
+    llvm::errs() << "Skipped TU over budget: " << SkippedTu << "\n";
+
   if (Result != 0) {
     return Result;
   }
@@ -83,4 +510,8 @@ int main(int argc, const char **argv) {
     llvm::outs() << DotFileContents;
     llvm::outs().flush();
   }
+
+  // Results are still printed for the TUs that were analyzed, but report
+  // failure so that skipped TUs don't go unnoticed.
+  return SkippedTus.empty() ? 0 : 1;
 }
@@ -1,8 +1,15 @@
 #include "HsmAstMatcher.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/MultiplexConsumer.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/DenseMap.h"
+#include <deque>
 
 using namespace clang;
 using namespace clang::ast_matchers;
+using namespace clang::tooling;
 
 namespace {
 bool areSameVariable(const ValueDecl *First, const ValueDecl *Second) {
@@ -138,6 +145,208 @@ public:
         SourceStateName, std::make_tuple(TransType, TargetStateName)));
   }
 };
+
+// Returns true if RD is hsm::State, compared the same way as the
+// isDerivedFrom("hsm::State") matcher does, i.e. skipping inline namespaces.
+bool isHsmStateDecl(const CXXRecordDecl *RD) {
+  const auto II = RD->getIdentifier();
+  if (!II || !II->isStr("State"))
+    return false;
+
+  const DeclContext *DC = RD->getDeclContext();
+  while (isa<NamespaceDecl>(DC) && cast<NamespaceDecl>(DC)->isInline())
+    DC = DC->getParent();
+
+  const auto ND = dyn_cast<NamespaceDecl>(DC);
+  if (!ND)
+    return false;
+  const auto NamespaceII = ND->getIdentifier();
+  return NamespaceII && NamespaceII->isStr("hsm");
+}
+
+// Returns true if the body of the function declared by D may declare a local
+// class with base classes, which could be a state. The body hasn't been parsed
+// yet, so this is a raw token scan of the source; classes declared by macros
+// are not seen.
+bool mayDeclareLocalDerivedClass(const Decl *D, const SourceManager &SM,
+                                 const LangOptions &LangOpts) {
+  const auto Loc = SM.getExpansionLoc(D->getLocation());
+  const auto LocInfo = SM.getDecomposedLoc(Loc);
+  bool Invalid = false;
+  const auto Buffer = SM.getBufferData(LocInfo.first, &Invalid);
+  if (Invalid)
+    return true;
+
+  Lexer RawLexer(SM.getLocForStartOfFile(LocInfo.first), LangOpts,
+                 Buffer.begin(), Buffer.begin() + LocInfo.second,
+                 Buffer.end());
+
+  auto isRawIdentifier = [](const Token &Tok, StringRef Name) {
+    return Tok.is(tok::raw_identifier) && Tok.getRawIdentifier() == Name;
+  };
+
+  // Find the opening brace of the body, skipping the parameter list and any
+  // braced member initializers of a constructor (e.g. ": Member{1} {").
+  Token Tok, PrevTok;
+  PrevTok.startToken();
+  int ParenDepth = 0;
+  bool InCtorInitializers = false;
+  for (;;) {
+    RawLexer.LexFromRawLexer(Tok);
+    if (Tok.is(tok::eof) || (ParenDepth == 0 && Tok.is(tok::semi)))
+      return true;
+
+    if (Tok.isOneOf(tok::l_paren, tok::l_square)) {
+      ++ParenDepth;
+    } else if (Tok.isOneOf(tok::r_paren, tok::r_square)) {
+      --ParenDepth;
+    } else if (ParenDepth == 0 && Tok.is(tok::colon)) {
+      InCtorInitializers = true;
+    } else if (ParenDepth == 0 && Tok.is(tok::l_brace)) {
+      if (!InCtorInitializers ||
+          !PrevTok.isOneOf(tok::raw_identifier, tok::greater,
+                           tok::greatergreater))
+        break;
+      for (int BraceDepth = 1; BraceDepth > 0;) {
+        RawLexer.LexFromRawLexer(Tok);
+        if (Tok.is(tok::eof))
+          return true;
+        if (Tok.is(tok::l_brace))
+          ++BraceDepth;
+        else if (Tok.is(tok::r_brace))
+          --BraceDepth;
+      }
+    }
+    PrevTok = Tok;
+  }
+
+  // Look for "class|struct Name [final] :" within the body, keeping the last
+  // few tokens to match against.
+  std::deque<Token> Recent;
+  for (int BraceDepth = 1; BraceDepth > 0;) {
+    RawLexer.LexFromRawLexer(Tok);
+    if (Tok.is(tok::eof))
+      return true;
+
+    if (Tok.is(tok::l_brace)) {
+      ++BraceDepth;
+    } else if (Tok.is(tok::r_brace)) {
+      --BraceDepth;
+    } else if (Tok.is(tok::colon)) {
+      auto iter = Recent.rbegin();
+      if (iter != Recent.rend() && isRawIdentifier(*iter, "final"))
+        ++iter;
+      if (iter != Recent.rend() && iter->is(tok::raw_identifier) &&
+          ++iter != Recent.rend() &&
+          (isRawIdentifier(*iter, "class") ||
+           isRawIdentifier(*iter, "struct"))) {
+        // Skip "enum class Name : Type"
+        if (++iter == Recent.rend() || !isRawIdentifier(*iter, "enum"))
+          return true;
+      }
+    }
+
+    Recent.push_back(Tok);
+    if (Recent.size() > 4)
+      Recent.pop_front();
+  }
+  return false;
+}
+
+// Forwards to the MatchFinder's consumer, but tells the parser to skip the
+// bodies of functions that can't contain state transitions we match on.
+class SkipNonStateFunctionBodiesConsumer : public MultiplexConsumer {
+  // Caches whether each class definition may be a state
+  llvm::DenseMap<const CXXRecordDecl *, bool> _MayBeState;
+  ASTContext *_Context = nullptr;
+
+public:
+  SkipNonStateFunctionBodiesConsumer(std::unique_ptr<ASTConsumer> Consumer)
+      : MultiplexConsumer(makeConsumers(std::move(Consumer))) {}
+
+  void Initialize(ASTContext &Context) override {
+    _Context = &Context;
+    MultiplexConsumer::Initialize(Context);
+  }
+
+  bool shouldSkipFunctionBody(Decl *D) override {
+    // Keep bodies of member functions of states, including those of local
+    // classes and lambdas nested within them.
+    for (auto DC = D->getDeclContext(); DC; DC = DC->getParent()) {
+      if (const auto RD = dyn_cast<CXXRecordDecl>(DC))
+        if (mayBeStateDecl(RD))
+          return false;
+    }
+
+    // Keep bodies that may declare a local state class, or it would never be
+    // parsed.
+    if (!_Context)
+      return false;
+    return !mayDeclareLocalDerivedClass(D, _Context->getSourceManager(),
+                                        _Context->getLangOpts());
+  }
+
+private:
+  // Returns true if RD derives from hsm::State, or if it has a dependent base
+  // (i.e. it's a template) for which we can't tell yet.
+  bool mayBeStateDecl(const CXXRecordDecl *RD) {
+    RD = RD->getDefinition();
+    if (!RD)
+      return false;
+
+    auto iter = _MayBeState.find(RD);
+    if (iter != _MayBeState.end())
+      return iter->second;
+
+    bool Result = false;
+    for (const auto &Base : RD->bases()) {
+      const auto BaseDecl = Base.getType()->getAsCXXRecordDecl();
+      if (!BaseDecl || isHsmStateDecl(BaseDecl) || mayBeStateDecl(BaseDecl)) {
+        Result = true;
+        break;
+      }
+    }
+    _MayBeState[RD] = Result;
+    return Result;
+  }
+
+  static std::vector<std::unique_ptr<ASTConsumer>>
+  makeConsumers(std::unique_ptr<ASTConsumer> Consumer) {
+    std::vector<std::unique_ptr<ASTConsumer>> Consumers;
+    Consumers.push_back(std::move(Consumer));
+    return Consumers;
+  }
+};
+
+class SkipNonStateFunctionBodiesAction : public ASTFrontendAction {
+  MatchFinder &_Finder;
+
+public:
+  SkipNonStateFunctionBodiesAction(MatchFinder &Finder) : _Finder(Finder) {}
+
+  bool BeginInvocation(CompilerInstance &CI) override {
+    CI.getFrontendOpts().SkipFunctionBodies = true;
+    return true;
+  }
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef InFile) override {
+    return llvm::make_unique<SkipNonStateFunctionBodiesConsumer>(
+        _Finder.newASTConsumer());
+  }
+};
+
+class SkipNonStateFunctionBodiesActionFactory : public FrontendActionFactory {
+  MatchFinder &_Finder;
+
+public:
+  SkipNonStateFunctionBodiesActionFactory(MatchFinder &Finder)
+      : _Finder(Finder) {}
+
+  FrontendAction *create() override {
+    return new SkipNonStateFunctionBodiesAction(_Finder);
+  }
+};
 } // namespace
 
 namespace HsmAstMatcher {
@@ -145,4 +354,12 @@ void addMatchers(MatchFinder &Finder, StateTransitionMap &Map) {
   static StateTransitionMapper Mapper(Map);
   Finder.addMatcher(StateTransitionMatcher, &Mapper);
 }
+
+std::unique_ptr<FrontendActionFactory>
+newFrontendActionFactory(MatchFinder &Finder,
+                         bool SkipNonStateFunctionBodies) {
+  if (SkipNonStateFunctionBodies)
+    return llvm::make_unique<SkipNonStateFunctionBodiesActionFactory>(Finder);
+  return tooling::newFrontendActionFactory(&Finder);
+}
 }
@@ -2,8 +2,17 @@
 
 #include "HsmTypes.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "clang/Tooling/Tooling.h"
 
 namespace HsmAstMatcher {
 void addMatchers(clang::ast_matchers::MatchFinder &Finder,
                  StateTransitionMap &Map);
+
+// Returns a factory for actions that run Finder on each TU. If
+// SkipNonStateFunctionBodies is true, function bodies are only parsed for
+// members of classes that may derive from hsm::State, as those are the only
+// ones in which transitions are matched.
+std::unique_ptr<clang::tooling::FrontendActionFactory>
+newFrontendActionFactory(clang::ast_matchers::MatchFinder &Finder,
+                         bool SkipNonStateFunctionBodies);
 }
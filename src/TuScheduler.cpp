@@ -0,0 +1,126 @@
+#include "TuScheduler.h"
+#include "StringHelpers.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+std::string formatDuration(double Seconds) {
+  auto Total = static_cast<unsigned>(std::max(0.0, Seconds) + 0.5);
+  auto Hours = Total / 3600;
+  auto Minutes = (Total / 60) % 60;
+  auto Secs = Total % 60;
+  if (Hours > 0)
+    return FormatString<64>("%uh%02um%02us", Hours, Minutes, Secs).value();
+  if (Minutes > 0)
+    return FormatString<64>("%um%02us", Minutes, Secs).value();
+  return FormatString<64>("%us", Secs).value();
+}
+} // namespace
+
+namespace TuScheduler {
+TimingMap loadTimings(const std::string &FilePath) {
+  TimingMap Timings;
+  auto Buffer = MemoryBuffer::getFile(FilePath);
+  if (!Buffer)
+    return Timings;
+
+  // Each line is: <seconds>\t<absolute source path>
+  SmallVector<StringRef, 64> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+  for (auto Line : Lines) {
+    auto Parts = Line.split('\t');
+    double Seconds = 0;
+    if (Parts.second.empty() || Parts.first.trim().getAsDouble(Seconds))
+      continue;
+    Timings[Parts.second.trim().str()] = Seconds;
+  }
+  return Timings;
+}
+
+bool saveTimings(const std::string &FilePath, const TimingMap &Timings) {
+  std::error_code EC;
+  raw_fd_ostream OS(FilePath, EC, sys::fs::F_Text);
+  if (EC)
+    return false;
+  for (auto &kvp : Timings)
+    OS << format("%.3f", kvp.second) << '\t' << kvp.first << '\n';
+  return true;
+}
+
+std::vector<Job> scheduleByCost(const std::vector<std::string> &SourcePaths,
+                                const TimingMap &Timings) {
+  std::vector<uint64_t> Sizes(SourcePaths.size(), 0);
+  double KnownSeconds = 0;
+  double KnownBytes = 0;
+  for (size_t i = 0; i < SourcePaths.size(); ++i) {
+    sys::fs::file_size(SourcePaths[i], Sizes[i]);
+    auto iter = Timings.find(SourcePaths[i]);
+    if (iter != Timings.end()) {
+      KnownSeconds += iter->second;
+      KnownBytes += Sizes[i];
+    }
+  }
+
+  // Estimate cost of TUs we have no timings for from the average time per
+  // byte of the ones we do. Without any timings, the file size is the cost.
+  double SecondsPerByte = 1.0;
+  if (KnownSeconds > 0 && KnownBytes > 0)
+    SecondsPerByte = KnownSeconds / KnownBytes;
+
+  std::vector<Job> Jobs;
+  for (size_t i = 0; i < SourcePaths.size(); ++i) {
+    auto iter = Timings.find(SourcePaths[i]);
+    double Cost = iter != Timings.end() ? iter->second
+                                        : Sizes[i] * SecondsPerByte;
+    Jobs.push_back({SourcePaths[i], Cost});
+  }
+
+  std::stable_sort(Jobs.begin(), Jobs.end(), [](const Job &A, const Job &B) {
+    return A.EstimatedCost > B.EstimatedCost;
+  });
+  return Jobs;
+}
+
+ProgressReporter::ProgressReporter(raw_ostream &OS,
+                                   const std::vector<Job> &Jobs)
+    : _OS(OS), _NumJobs(Jobs.size()), _StartTime(Clock::now()) {
+  for (auto &J : Jobs)
+    _TotalCost += J.EstimatedCost;
+}
+
+void ProgressReporter::jobStarted(const Job &J) {
+  ++_NumJobsStarted;
+  _OS << "[" << _NumJobsStarted << "/" << _NumJobs << "] " << J.SourcePath
+      << "\n";
+  _OS.flush();
+}
+
+void ProgressReporter::jobFinished(const Job &J, double Seconds,
+                                   const char *Status) {
+  ++_NumJobsDone;
+  _DoneCost += J.EstimatedCost;
+
+  std::string Eta = "unknown";
+  const double RemainingCost = std::max(0.0, _TotalCost - _DoneCost);
+  if (_NumJobsDone >= _NumJobs) {
+    Eta = formatDuration(0);
+  } else if (_DoneCost > 0) {
+    // Assume remaining jobs run at the same rate, relative to their estimated
+    // cost, as the ones done so far. This also holds when jobs run in
+    // parallel, as the rate then includes the parallelism.
+    std::chrono::duration<double> Elapsed = Clock::now() - _StartTime;
+    Eta = formatDuration(Elapsed.count() * RemainingCost / _DoneCost);
+  }
+
+  _OS << "[" << _NumJobsDone << "/" << _NumJobs << "] " << J.SourcePath << ": "
+      << Status << " in " << format("%.1f", Seconds) << "s, ETA " << Eta
+      << "\n";
+  _OS.flush();
+}
+} // namespace TuScheduler
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace TuScheduler {
+// Map of absolute source path to how long (in seconds) it last took to analyze
+using TimingMap = std::map<std::string, double>;
+
+// Loads timings from file; returns an empty map if the file does not exist
+TimingMap loadTimings(const std::string &FilePath);
+bool saveTimings(const std::string &FilePath, const TimingMap &Timings);
+
+struct Job {
+  std::string SourcePath;
+  double EstimatedCost; // In seconds if any timings are known, else in bytes
+};
+
+// Returns one job per source path, ordered from most to least expensive so
+// that slow translation units don't end up being started last. Cost is taken
+// from Timings when available, otherwise it is estimated from file size.
+std::vector<Job> scheduleByCost(const std::vector<std::string> &SourcePaths,
+                                const TimingMap &Timings);
+
+// Reports per-job progress and an estimated time remaining. Not thread-safe.
+class ProgressReporter {
+  using Clock = std::chrono::steady_clock;
+
+  llvm::raw_ostream &_OS;
+  size_t _NumJobs;
+  size_t _NumJobsStarted = 0;
+  size_t _NumJobsDone = 0;
+  double _TotalCost = 0;
+  double _DoneCost = 0;
+  Clock::time_point _StartTime;
+
+public:
+  ProgressReporter(llvm::raw_ostream &OS, const std::vector<Job> &Jobs);
+
+  void jobStarted(const Job &J);
+  void jobFinished(const Job &J, double Seconds, const char *Status = "done");
+};
+} // namespace TuScheduler